@@ -0,0 +1,50 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Parallelizer.h"
+#include "Shaper.h"
+#include "Types.h"
+
+// Addresses are either "unix:/path/to.sock" (or a bare path) or "tcp:host:port".
+// Messages are sent in host byte order, so all peers must share the architecture.
+// A worker not answering within timeout_s seconds is treated as dead.
+
+class Distributor {
+    struct worker_conn {
+        int fd;
+        std::string addr;
+    };
+
+    std::vector<worker_conn> workers;
+    const int timeout_s;
+
+    void drop(worker_conn &w);
+
+public:
+    typedef std::vector<shape_candidate>::iterator iterator;
+    typedef std::function<void(iterator, iterator)> score_fn;
+
+    Distributor(const std::vector<std::string> &addrs, const alpha_img_t &base_img, const Shaper &shp,
+                int timeout_s = 60);
+
+    ~Distributor();
+
+    Distributor(const Distributor &) = delete;
+
+    Distributor &operator=(const Distributor &) = delete;
+
+    int alive_count() const;
+
+    // Splits [begin, begin + count) between the workers and local_fn, shares of
+    // dead workers are rescored with local_fn
+    void score(iterator begin, int count, const score_fn &local_fn);
+
+    // Broadcasts the shape added to the canvas
+    void commit(const shape_metadata &md);
+};
+
+// Listens on addr and scores batches for one coordinator at a time, never returns
+void run_worker(const std::string &addr, const alpha_img_t &base_img, const Shaper &shp, Parallelizer &pll);
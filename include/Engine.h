@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Distributor.h"
+#include "Parallelizer.h"
+#include "Shaper.h"
+#include "SpatialGrid.h"
+#include "Types.h"
+
+struct engine_options {
+    int initial_swarm = 800;
+    int survived_count = 150;
+    int children_count = 5;
+    int generations_count = 5;
+    int threads_count = 16;
+    // Keep swarm candidates not overlapped by the added shape with their scores
+    bool reuse_swarm = false;
+    // See Shaper::setOptimalColor
+    bool optimal_color = false;
+    // Addresses of workers, see Distributor
+    std::vector<std::string> workers;
+    // Seconds to wait for a worker before rescoring its share locally
+    int worker_timeout = 60;
+};
+
+enum engine_stage {
+    STAGE_SWARM_READY,
+    STAGE_GENERATION_DONE,
+    STAGE_SHAPE_ADDED
+};
+
+struct engine_progress {
+    engine_stage stage;
+    int shape_i;
+    int generation_i;
+    // Number of candidates scored during the stage
+    int evaluated;
+    int64_t score_delta;
+    int pretty_score;
+};
+
+class Engine {
+    const engine_options opts;
+    Shaper shp;
+    Parallelizer pll;
+    std::unique_ptr<Distributor> dst;
+
+    alpha_img_t base_img;
+    alpha_img_t canvas;
+    long long score = 0;
+    int shapes_count = 0;
+
+    std::vector<shape_candidate> swarm;
+    std::vector<shape_bounds> swarm_bounds;
+    std::vector<char> swarm_stale;
+    SpatialGrid swarm_grid;
+
+    std::vector<shape_candidate> shapes;
+    std::vector<shape_candidate> winners;
+    std::vector<shape_candidate> best_from_gen;
+
+    std::atomic_bool cancelled = false;
+    std::function<void(const engine_progress &)> progress_cb;
+
+    void report(engine_stage stage, int generation_i, int evaluated, int64_t score_delta) const;
+
+    // Replaces stale swarm candidates with new scored ones, returns their count
+    int refresh_swarm();
+
+    void invalidate_swarm(const shape_metadata &md);
+
+    void score_local(std::vector<shape_candidate>::iterator begin, std::vector<shape_candidate>::iterator end);
+
+    // Scores first count candidates of shapes
+    void score_shapes(int count);
+
+    // Returns false if cancelled or past the deadline before the shape was chosen,
+    // checked after the swarm is scored and before each generation
+    bool add_shape(std::chrono::steady_clock::time_point deadline);
+
+    // Adds up to n shapes while the deadline is not reached, clears any earlier cancellation first
+    int run(int n, std::chrono::steady_clock::time_point deadline);
+
+public:
+    Engine(const std::string &shapes_dir, boost::gil::point<int> shape_sz, const engine_options &opts);
+
+    // Starts over with a blank canvas, shapes and threads are kept
+    void set_base_image(const alpha_img_t &img);
+
+    // Adds up to n shapes, returns how many were added before cancellation
+    int step(int n = 1);
+
+    // Adds shapes until the budget runs out, a shape still in progress is dropped at
+    // the next check (after the swarm is scored or between generations), so the
+    // budget may be overrun by one scoring pass
+    int run_for(std::chrono::milliseconds budget);
+
+    // Stops the running step/run_for at its next check (after the swarm is scored or
+    // between generations), the shape in progress is dropped, safe to call from any thread
+    void cancel();
+
+    void set_progress_callback(std::function<void(const engine_progress &)> cb);
+
+    const alpha_img_t &get_canvas() const;
+
+    int get_shapes_count() const;
+
+    int get_workers_count() const;
+
+    int get_pretty_score() const;
+};
@@ -8,7 +8,18 @@ alpha_img_t scale_image(const alpha_img_t &img, const boost::gil::point<int>& sz
 
 alpha_img_t transform_image(const alpha_img_t &img, double deg, double sz_mul, const pix_t &col);
 
-alpha_img_t read_png_or_jpg(const std::string &path);
+// Same as transform_image, but the color is fitted while rasterizing: it minimizes the squared
+// error between base_img and canvas blended with the shape placed at coords
+alpha_img_t transform_image_fit_color(const alpha_img_t &img, double deg, double sz_mul,
+                                      const alpha_img_t &base_img, const alpha_img_t &canvas,
+                                      boost::gil::point<int> coords);
+
+// Format is detected by magic bytes, with max_size > 0 the image is downscaled while
+// decoding so its longest side fits into max_size
+alpha_img_t read_png_or_jpg(const std::string &path, int max_size = -1);
+
+// FNV-1a over dimensions and pixels, chained through seed
+uint64_t image_checksum(const alpha_img_t &img, uint64_t seed = 14695981039346656037ull);
 
 int color_similarity_score(const alpha_pix_t &c1, const alpha_pix_t &c2);
 
@@ -13,9 +13,20 @@ struct shape_metadata {
     int idx;
 };
 
+struct shape_candidate {
+    int64_t score_delta;
+    shape_metadata md;
+};
+
+// Canvas area touched by a shape, high bounds are exclusive
+struct shape_bounds {
+    int xlow, xhigh, ylow, yhigh;
+};
+
 class Shaper {
     std::vector<alpha_img_t> templates;
     alpha_img_t base_img;
+    bool optimal_color = false;
     struct {
         int xlow, xhigh, ylow, yhigh;
     } coords_bounds;
@@ -26,14 +37,33 @@ public:
     const float mut_boundaries_base_img_mul = 0.2;
     const float mut_boundaries_shape_deg = 40;
     const float mut_boundaries_shape_sz_mul = 0.3;
+    // Limits for shapes received from peers, far beyond what mutations reach
+    const double valid_boundaries_shape_deg = 1e6;
+    const double valid_boundaries_sz_base_img_mul = 8;
 
     explicit Shaper(const std::string &dir, boost::gil::point<int> shape_sz);
 
     void setBaseImage(const alpha_img_t &img);
 
+    // Fit the fill color to the transformed footprint and the canvas instead of
+    // averaging the base image under the template
+    void setOptimalColor(bool enabled);
+
+    bool isOptimalColor() const;
+
     shape_metadata mutateShapeData(const shape_metadata &md) const;
 
-    alpha_img_t applyShapeData(const shape_metadata &md) const;
+    alpha_img_t applyShapeData(const shape_metadata &md, const alpha_img_t &canvas) const;
 
     shape_metadata generateShapeData() const;
+
+    shape_bounds getShapeBounds(const shape_metadata &md) const;
+
+    // False if md refers to a missing template or is too far off to be applied safely
+    bool isValidShapeData(const shape_metadata &md) const;
+
+    int templatesCount() const;
+
+    // Checksum of all templates, see image_checksum
+    uint64_t templatesChecksum() const;
 };
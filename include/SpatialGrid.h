@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+// Buckets ids by the grid cells their rectangles touch, rectangles are
+// half-open and clipped to the grid area
+class SpatialGrid {
+    int cell_sz = 1;
+    int cols = 0;
+    int rows = 0;
+    std::vector<std::vector<int> > cells;
+
+    bool clip(int &xlow, int &ylow, int &xhigh, int &yhigh) const {
+        xlow = std::max(xlow, 0) / cell_sz;
+        ylow = std::max(ylow, 0) / cell_sz;
+        xhigh = std::min(xhigh, cols * cell_sz);
+        yhigh = std::min(yhigh, rows * cell_sz);
+        if (xhigh <= 0 || yhigh <= 0) return false;
+        xhigh = (xhigh - 1) / cell_sz;
+        yhigh = (yhigh - 1) / cell_sz;
+        return xlow <= xhigh && ylow <= yhigh;
+    }
+
+public:
+    SpatialGrid() = default;
+
+    SpatialGrid(int width, int height, int cell_sz)
+        : cell_sz(cell_sz),
+          cols((width + cell_sz - 1) / cell_sz),
+          rows((height + cell_sz - 1) / cell_sz),
+          cells(cols * rows) {
+    }
+
+    void clear() {
+        for (auto &cell: cells) cell.clear();
+    }
+
+    void insert(int id, int xlow, int ylow, int xhigh, int yhigh) {
+        if (!clip(xlow, ylow, xhigh, yhigh)) return;
+        for (int cy = ylow; cy <= yhigh; ++cy) {
+            for (int cx = xlow; cx <= xhigh; ++cx) {
+                cells[cy * cols + cx].push_back(id);
+            }
+        }
+    }
+
+    // Calls fn for ids sharing a cell with the rectangle, an id may be reported more than once
+    template<typename Fn>
+    void query(int xlow, int ylow, int xhigh, int yhigh, Fn fn) const {
+        if (!clip(xlow, ylow, xhigh, yhigh)) return;
+        for (int cy = ylow; cy <= yhigh; ++cy) {
+            for (int cx = xlow; cx <= xhigh; ++cx) {
+                for (int id: cells[cy * cols + cx]) fn(id);
+            }
+        }
+    }
+};
@@ -0,0 +1,362 @@
+#include "Distributor.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <boost/gil/image.hpp>
+
+#include "ImageOps.h"
+
+using namespace boost::gil;
+
+namespace {
+    enum message_type : uint32_t {
+        MSG_HELLO = 1,
+        MSG_SCORE,
+        MSG_SCORES,
+        MSG_COMMIT,
+    };
+
+    struct wire_header {
+        uint32_t type;
+        uint32_t count;
+    };
+
+    struct wire_hello {
+        int32_t width;
+        int32_t height;
+        int32_t templates_count;
+        int32_t flags;
+        // Of the base image and templates, catches different inputs of the same size
+        uint64_t checksum;
+    };
+
+    // Largest batch accepted from a peer, anything above is treated as a broken stream
+    constexpr uint32_t max_message_count = 1 << 20;
+
+    struct wire_shape {
+        int32_t x, y;
+        double deg;
+        double sz_mul;
+        int32_t idx;
+        int32_t pad;
+    };
+
+    wire_shape to_wire(const shape_metadata &md) {
+        return {md.coords.x, md.coords.y, md.deg, md.sz_mul, md.idx, 0};
+    }
+
+    shape_metadata from_wire(const wire_shape &ws) {
+        return {{ws.x, ws.y}, ws.deg, ws.sz_mul, ws.idx};
+    }
+
+    enum hello_flags : int32_t {
+        HELLO_OPTIMAL_COLOR = 1
+    };
+
+    wire_hello make_hello(const alpha_img_t &base_img, const Shaper &shp) {
+        return {
+            static_cast<int32_t>(base_img.width()), static_cast<int32_t>(base_img.height()),
+            shp.templatesCount(), shp.isOptimalColor() ? HELLO_OPTIMAL_COLOR : 0,
+            image_checksum(base_img, shp.templatesChecksum())
+        };
+    }
+
+    bool send_all(int fd, const void *data, size_t size) {
+        auto ptr = static_cast<const char *>(data);
+        while (size) {
+            ssize_t n = ::send(fd, ptr, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            ptr += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool recv_all(int fd, void *data, size_t size) {
+        auto ptr = static_cast<char *>(data);
+        while (size) {
+            ssize_t n = ::recv(fd, ptr, size, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            ptr += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    template<typename T>
+    bool send_message(int fd, message_type type, const T *payload, uint32_t count) {
+        wire_header hdr{type, count};
+        return send_all(fd, &hdr, sizeof(hdr))
+               && send_all(fd, payload, sizeof(T) * count);
+    }
+
+    template<typename T>
+    bool recv_message(int fd, message_type type, std::vector<T> &payload) {
+        wire_header hdr{};
+        if (!recv_all(fd, &hdr, sizeof(hdr)) || hdr.type != type || hdr.count > max_message_count) return false;
+        payload.resize(hdr.count);
+        return recv_all(fd, payload.data(), sizeof(T) * hdr.count);
+    }
+
+    // Blocking calls on fd fail after timeout_s seconds, TCP peers are also probed with keepalive
+    void set_timeouts(int fd, int timeout_s) {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+        if (timeout_s <= 0) return;
+
+        timeval tv{timeout_s, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+    // Returns a socket either bound and listening or connected to addr,
+    // connected sockets get timeout_s applied before connecting
+    int open_socket(const std::string &addr, bool listening, int timeout_s = 0) {
+        if (addr.starts_with("tcp:")) {
+            auto hostport = addr.substr(4);
+            auto sep = hostport.rfind(':');
+            if (sep == std::string::npos) {
+                throw std::invalid_argument("tcp address must be of form tcp:host:port: " + addr);
+            }
+            addrinfo hints{};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = listening ? AI_PASSIVE : 0;
+            addrinfo *res = nullptr;
+            if (getaddrinfo(hostport.substr(0, sep).c_str(), hostport.substr(sep + 1).c_str(), &hints, &res)) {
+                throw std::runtime_error("failed to resolve address: " + addr);
+            }
+            int fd = -1;
+            for (auto ai = res; ai; ai = ai->ai_next) {
+                fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+                if (fd < 0) continue;
+                int one = 1;
+                if (listening) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                else set_timeouts(fd, timeout_s);
+                if (listening
+                        ? ::bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, 1) == 0
+                        : ::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                    break;
+                }
+                ::close(fd);
+                fd = -1;
+            }
+            freeaddrinfo(res);
+            if (fd < 0) {
+                throw std::runtime_error("failed to open socket " + addr + ": " + std::strerror(errno));
+            }
+            return fd;
+        }
+
+        auto path = addr.starts_with("unix:") ? addr.substr(5) : addr;
+        sockaddr_un sa{};
+        if (path.size() >= sizeof(sa.sun_path)) {
+            throw std::invalid_argument("unix socket path is too long: " + path);
+        }
+        sa.sun_family = AF_UNIX;
+        std::strncpy(sa.sun_path, path.c_str(), sizeof(sa.sun_path) - 1);
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            throw std::runtime_error("failed to create socket: " + std::string(std::strerror(errno)));
+        }
+        if (listening) ::unlink(path.c_str());
+        else set_timeouts(fd, timeout_s);
+        auto sa_ptr = reinterpret_cast<const sockaddr *>(&sa);
+        if (listening
+                ? ::bind(fd, sa_ptr, sizeof(sa)) != 0 || ::listen(fd, 1) != 0
+                : ::connect(fd, sa_ptr, sizeof(sa)) != 0) {
+            ::close(fd);
+            throw std::runtime_error("failed to open socket " + addr + ": " + std::strerror(errno));
+        }
+        return fd;
+    }
+}
+
+Distributor::Distributor(const std::vector<std::string> &addrs, const alpha_img_t &base_img,
+                         const Shaper &shp, int timeout_s) : timeout_s(timeout_s) {
+    const auto hello = make_hello(base_img, shp);
+
+    for (const auto &addr: addrs) {
+        int fd;
+        try {
+            fd = open_socket(addr, false, timeout_s);
+        } catch (std::exception &e) {
+            std::cerr << "Distributor: " << e.what() << '\n';
+            continue;
+        }
+
+        std::vector<wire_hello> reply;
+        if (!send_message(fd, MSG_HELLO, &hello, 1)
+            || !recv_message(fd, MSG_HELLO, reply) || reply.size() != 1
+            || std::memcmp(&reply[0], &hello, sizeof(hello)) != 0) {
+            std::cerr << "Distributor: worker \"" << addr << "\" rejected, inputs or options differ\n";
+            ::close(fd);
+            continue;
+        }
+        workers.push_back({fd, addr});
+    }
+}
+
+Distributor::~Distributor() {
+    for (auto &w: workers) {
+        if (w.fd >= 0) ::close(w.fd);
+    }
+}
+
+void Distributor::drop(worker_conn &w) {
+    std::cerr << "Distributor: lost worker \"" << w.addr << "\"\n";
+    ::close(w.fd);
+    w.fd = -1;
+}
+
+int Distributor::alive_count() const {
+    int count = 0;
+    for (const auto &w: workers) {
+        if (w.fd >= 0) count++;
+    }
+    return count;
+}
+
+void Distributor::score(iterator begin, int count, const score_fn &local_fn) {
+    std::vector<worker_conn *> alive;
+    for (auto &w: workers) {
+        if (w.fd >= 0) alive.push_back(&w);
+    }
+    if (alive.empty()) {
+        local_fn(begin, begin + count);
+        return;
+    }
+
+    // Last share is scored locally and takes the remainder
+    const int shares_count = static_cast<int>(alive.size()) + 1;
+    const int per_share = count / shares_count;
+    std::vector<std::pair<iterator, iterator> > orphaned;
+
+    std::vector<wire_shape> batch;
+    for (size_t i = 0; i < alive.size(); ++i) {
+        auto lbound = begin + per_share * i;
+        batch.clear();
+        for (auto it = lbound; it != lbound + per_share; ++it) {
+            batch.push_back(to_wire(it->md));
+        }
+        if (!send_message(alive[i]->fd, MSG_SCORE, batch.data(), batch.size())) {
+            drop(*alive[i]);
+        }
+    }
+
+    local_fn(begin + per_share * alive.size(), begin + count);
+
+    std::vector<int64_t> scores;
+    for (size_t i = 0; i < alive.size(); ++i) {
+        auto lbound = begin + per_share * i;
+        auto rbound = lbound + per_share;
+        if (alive[i]->fd < 0
+            || !recv_message(alive[i]->fd, MSG_SCORES, scores) || static_cast<int>(scores.size()) != per_share) {
+            if (alive[i]->fd >= 0) drop(*alive[i]);
+            orphaned.emplace_back(lbound, rbound);
+            continue;
+        }
+        for (int si = 0; si < per_share; ++si) {
+            (lbound + si)->score_delta = scores[si];
+        }
+    }
+
+    for (const auto &[lbound, rbound]: orphaned) {
+        local_fn(lbound, rbound);
+    }
+}
+
+void Distributor::commit(const shape_metadata &md) {
+    const auto ws = to_wire(md);
+    for (auto &w: workers) {
+        if (w.fd >= 0 && !send_message(w.fd, MSG_COMMIT, &ws, 1)) {
+            drop(w);
+        }
+    }
+}
+
+void run_worker(const std::string &addr, const alpha_img_t &base_img, const Shaper &shp, Parallelizer &pll) {
+    const auto hello = make_hello(base_img, shp);
+    int lfd = open_socket(addr, true);
+    std::cout << "Worker: listening on " << addr << std::endl;
+
+    alpha_img_t canvas(base_img.dimensions());
+    std::vector<shape_candidate> shapes;
+    std::vector<wire_shape> batch;
+    std::vector<int64_t> scores;
+
+    while (true) {
+        int fd = ::accept(lfd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("Worker: accept failed: " + std::string(std::strerror(errno)));
+        }
+        // No timeouts, the coordinator may be idle between batches for long
+        set_timeouts(fd, 0);
+
+        // The reply is sent even on mismatch, so the coordinator reports the rejection
+        std::vector<wire_hello> peer_hello;
+        if (!recv_message(fd, MSG_HELLO, peer_hello)
+            || !send_message(fd, MSG_HELLO, &hello, 1)
+            || peer_hello.size() != 1 || std::memcmp(&peer_hello[0], &hello, sizeof(hello)) != 0) {
+            std::cerr << "Worker: coordinator rejected, inputs or options differ\n";
+            ::close(fd);
+            continue;
+        }
+        std::cout << "Worker: coordinator connected" << std::endl;
+        fill_pixels(view(canvas), alpha_pix_t(0, 0, 0, 0));
+
+        wire_header hdr{};
+        while (recv_all(fd, &hdr, sizeof(hdr))) {
+            if (hdr.count > max_message_count) break;
+            batch.resize(hdr.count);
+            if (!recv_all(fd, batch.data(), sizeof(wire_shape) * hdr.count)) break;
+            if (hdr.type != MSG_COMMIT && hdr.type != MSG_SCORE) break;
+
+            shapes.resize(batch.size());
+            bool valid = true;
+            for (size_t i = 0; i < batch.size() && valid; ++i) {
+                shapes[i].md = from_wire(batch[i]);
+                valid = shp.isValidShapeData(shapes[i].md);
+            }
+            if (!valid) {
+                std::cerr << "Worker: invalid shape received\n";
+                break;
+            }
+
+            if (hdr.type == MSG_COMMIT) {
+                for (const auto &sh: shapes) {
+                    overlay_compare(base_img, canvas, shp.applyShapeData(sh.md, canvas), sh.md.coords, true);
+                }
+                continue;
+            }
+            pll.call(shapes, shapes.size(), [&](auto sh_it, auto sh_end) {
+                for (; sh_it != sh_end; ++sh_it) {
+                    sh_it->score_delta = overlay_compare(base_img, canvas,
+                                                         shp.applyShapeData(sh_it->md, canvas),
+                                                         sh_it->md.coords);
+                }
+            });
+            scores.resize(shapes.size());
+            for (size_t i = 0; i < shapes.size(); ++i) {
+                scores[i] = shapes[i].score_delta;
+            }
+            if (!send_message(fd, MSG_SCORES, scores.data(), scores.size())) break;
+        }
+        ::close(fd);
+        std::cout << "Worker: coordinator disconnected" << std::endl;
+    }
+}
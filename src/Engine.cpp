@@ -0,0 +1,221 @@
+#include "Engine.h"
+
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+
+#include <boost/gil/image.hpp>
+
+#include "ImageOps.h"
+
+using namespace boost::gil;
+
+#define map_range(a1,a2,b1,b2,s) (b1 + (s - a1) * (b2 - b1) / (a2 - a1))
+#define pretty_score(overall, score) map_range(0, (overall * 765), 0, 10000, score)
+
+Engine::Engine(const std::string &shapes_dir, point<int> shape_sz, const engine_options &opts)
+    : opts(opts),
+      shp(shapes_dir, shape_sz),
+      pll(opts.threads_count),
+      swarm(opts.initial_swarm),
+      swarm_bounds(opts.initial_swarm),
+      swarm_stale(opts.initial_swarm, 1),
+      shapes(std::max(opts.survived_count * opts.children_count, opts.initial_swarm)),
+      winners(opts.survived_count),
+      best_from_gen(opts.generations_count) {
+    if (opts.survived_count > opts.initial_swarm) {
+        throw std::invalid_argument("Engine: survived_count exceeds initial_swarm");
+    }
+    shp.setOptimalColor(opts.optimal_color);
+}
+
+void Engine::set_base_image(const alpha_img_t &img) {
+    base_img = img;
+    shp.setBaseImage(base_img);
+
+    // TODO: create an ability to pass existing canvas
+    canvas.recreate(base_img.dimensions());
+    fill_pixels(view(canvas), alpha_pix_t(0, 0, 0, 0));
+    score = 0;
+    shapes_count = 0;
+
+    const int grid_cell_sz = std::max<int>(16, std::max(base_img.width(), base_img.height()) / 32);
+    swarm_grid = SpatialGrid(base_img.width(), base_img.height(), grid_cell_sz);
+    std::ranges::fill(swarm_stale, 1);
+
+    dst.reset();
+    dst = std::make_unique<Distributor>(opts.workers, base_img, shp, opts.worker_timeout);
+}
+
+void Engine::report(engine_stage stage, int generation_i, int evaluated, int64_t score_delta) const {
+    if (!progress_cb) return;
+    progress_cb({stage, shapes_count, generation_i, evaluated, score_delta, get_pretty_score()});
+}
+
+void Engine::score_local(std::vector<shape_candidate>::iterator begin, std::vector<shape_candidate>::iterator end) {
+    pll.call<std::vector<shape_candidate> >(begin, end - begin, [&](auto sh_it, auto sh_end) {
+        for (; sh_it != sh_end; ++sh_it) {
+            shape_candidate &sh = *sh_it;
+            sh.score_delta = overlay_compare(base_img, canvas,
+                                             shp.applyShapeData(sh.md, canvas), sh.md.coords);
+        }
+    });
+}
+
+void Engine::score_shapes(int count) {
+    dst->score(shapes.begin(), count, [this](auto begin, auto end) {
+        score_local(begin, end);
+    });
+}
+
+int Engine::refresh_swarm() {
+    if (!opts.reuse_swarm) {
+        std::ranges::fill(swarm_stale, 1);
+    }
+
+    int stale_count = 0;
+    for (int si = 0; si < opts.initial_swarm; ++si) {
+        if (swarm_stale[si]) shapes[stale_count++].md = shp.generateShapeData();
+    }
+    score_shapes(stale_count);
+    for (int si = 0, fi = 0; si < opts.initial_swarm; ++si) {
+        if (!swarm_stale[si]) continue;
+        swarm[si] = shapes[fi++];
+        swarm_stale[si] = 0;
+    }
+
+    std::sort(swarm.begin(), swarm.end(), [](const shape_candidate &a, const shape_candidate &b) {
+        return a.score_delta > b.score_delta;
+    });
+
+    if (opts.reuse_swarm) {
+        swarm_grid.clear();
+        for (int si = 0; si < opts.initial_swarm; ++si) {
+            const auto &b = swarm_bounds[si] = shp.getShapeBounds(swarm[si].md);
+
+            // Only improving candidates visible on the canvas are worth keeping,
+            // the rest could never be invalidated by an added shape
+            const bool on_canvas = std::max(b.xlow, 0) < std::min<int>(b.xhigh, base_img.width())
+                                   && std::max(b.ylow, 0) < std::min<int>(b.yhigh, base_img.height());
+            if (!on_canvas || swarm[si].score_delta <= 0) {
+                swarm_stale[si] = 1;
+                continue;
+            }
+            swarm_grid.insert(si, b.xlow, b.ylow, b.xhigh, b.yhigh);
+        }
+    }
+    return stale_count;
+}
+
+void Engine::invalidate_swarm(const shape_metadata &md) {
+    if (!opts.reuse_swarm) return;
+
+    // Scores depend only on the canvas under the candidate, so only overlapping ones changed
+    const auto cb = shp.getShapeBounds(md);
+    swarm_grid.query(cb.xlow, cb.ylow, cb.xhigh, cb.yhigh, [&](int si) {
+        const auto &b = swarm_bounds[si];
+        if (b.xlow < cb.xhigh && cb.xlow < b.xhigh && b.ylow < cb.yhigh && cb.ylow < b.yhigh) {
+            swarm_stale[si] = 1;
+        }
+    });
+}
+
+// TODO: new algorithm - make edge detection
+// allow coordinates only near edges, then remove this mask
+// and let it fix the imperfections near edges (expected to be by design already)
+
+// TODO: make overlay_compare computed by gpu
+// need to compute each pixel in parallel
+// adapt image type and matrix type to opencl
+// simplify GIL if needed
+// perform matrix multiplications in parallel
+bool Engine::add_shape(std::chrono::steady_clock::time_point deadline) {
+    const auto stopped = [&] {
+        return cancelled || std::chrono::steady_clock::now() >= deadline;
+    };
+    const auto comparator = [](const shape_candidate &a, const shape_candidate &b) {
+        return a.score_delta > b.score_delta;
+    };
+
+    const int swarm_evaluated = refresh_swarm();
+    report(STAGE_SWARM_READY, 0, swarm_evaluated, swarm[0].score_delta);
+    if (stopped()) return false;
+
+    // move winners to another storage
+    for (int wi = 0; wi < opts.survived_count; ++wi) {
+        winners[wi] = swarm[wi];
+    }
+
+    const int children_total = opts.survived_count * opts.children_count;
+    for (int gi = 0; gi < opts.generations_count; ++gi) {
+        if (stopped()) return false;
+
+        for (int wi = 0; wi < opts.survived_count; ++wi) {
+            for (int ch = 0; ch < opts.children_count; ++ch) {
+                shapes[wi * opts.children_count + ch].md = shp.mutateShapeData(winners[wi].md);
+            }
+        }
+        score_shapes(children_total);
+        std::sort(shapes.begin(), shapes.begin() + children_total, comparator);
+
+        best_from_gen[gi] = shapes[0];
+        report(STAGE_GENERATION_DONE, gi, children_total, shapes[0].score_delta);
+    }
+    std::ranges::sort(best_from_gen, comparator);
+
+    const auto &winwin = best_from_gen[0];
+    score += winwin.score_delta;
+    overlay_compare(base_img, canvas, shp.applyShapeData(winwin.md, canvas), winwin.md.coords, true);
+    dst->commit(winwin.md);
+    invalidate_swarm(winwin.md);
+    shapes_count++;
+
+    report(STAGE_SHAPE_ADDED, opts.generations_count, 0, winwin.score_delta);
+    return true;
+}
+
+int Engine::run(int n, std::chrono::steady_clock::time_point deadline) {
+    if (!dst) {
+        throw std::runtime_error("Engine: base image is not set");
+    }
+    cancelled = false;
+    int added = 0;
+    for (; added < n && std::chrono::steady_clock::now() < deadline; ++added) {
+        if (cancelled || !add_shape(deadline)) break;
+    }
+    return added;
+}
+
+int Engine::step(int n) {
+    return run(n, std::chrono::steady_clock::time_point::max());
+}
+
+int Engine::run_for(std::chrono::milliseconds budget) {
+    return run(INT_MAX, std::chrono::steady_clock::now() + budget);
+}
+
+void Engine::cancel() {
+    cancelled = true;
+}
+
+void Engine::set_progress_callback(std::function<void(const engine_progress &)> cb) {
+    progress_cb = std::move(cb);
+}
+
+const alpha_img_t &Engine::get_canvas() const {
+    return canvas;
+}
+
+int Engine::get_shapes_count() const {
+    return shapes_count;
+}
+
+int Engine::get_workers_count() const {
+    return dst ? dst->alive_count() : 0;
+}
+
+int Engine::get_pretty_score() const {
+    const long base_pix_count = base_img.height() * base_img.width();
+    if (!base_pix_count) return 0;
+    return pretty_score(base_pix_count, score);
+}
@@ -1,11 +1,16 @@
 #include "ImageOps.h"
 
-#include <boost/gil/image.hpp>
-#include <boost/gil/io/read_image.hpp>
+#include <csetjmp>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+
+#include <jpeglib.h>
+#include <png.h>
 
-#include <boost/gil/extension/io/jpeg.hpp>
-#include <boost/gil/extension/io/png.hpp>
+#include <boost/gil/image.hpp>
 
+#include <boost/gil/extension/numeric/affine.hpp>
 #include <boost/gil/extension/numeric/resample.hpp>
 #include <boost/gil/extension/numeric/sampler.hpp>
 
@@ -37,6 +42,8 @@ alpha_img_t scale_image(const alpha_img_t &img, const point<int> &sz) {
 alpha_img_t transform_image(const alpha_img_t &img, double deg, double sz_mul, const pix_t &col) {
     auto new_dim = img.dimensions() * sz_mul;
     alpha_img_t tr_img(point<long int>{static_cast<int>(new_dim.x), static_cast<int>(new_dim.y)});
+    // Samples falling outside of the source are left untouched, keep them transparent
+    fill_pixels(view(tr_img), alpha_pix_t(0, 0, 0, 0));
 
     resample_subimage(const_view(img), view(tr_img), 0.0, 0.0,
                       img.width(), img.height(), deg * M_PI / 180., nearest_neighbor_sampler());
@@ -44,24 +51,287 @@ alpha_img_t transform_image(const alpha_img_t &img, double deg, double sz_mul, c
     return colorize_mask(tr_img, col);
 }
 
-alpha_img_t read_png_or_jpg(const std::string &path) {
-    alpha_img_t img;
+alpha_img_t transform_image_fit_color(const alpha_img_t &img, double deg, double sz_mul,
+                                      const alpha_img_t &base_img, const alpha_img_t &canvas,
+                                      point<int> coords) {
+    auto new_dim = img.dimensions() * sz_mul;
+    alpha_img_t tr_img(point<long int>{static_cast<int>(new_dim.x), static_cast<int>(new_dim.y)});
+
+    auto sview = const_view(img);
+    auto tview = view(tr_img);
+    auto cview = const_view(canvas);
+    auto bview = const_view(base_img);
+
+    // Same mapping as resample_subimage in transform_image
+    const double src_width = std::max<double>(sview.width() - 1, 1);
+    const double src_height = std::max<double>(sview.height() - 1, 1);
+    const double dst_width = std::max<double>(tview.width() - 1, 1);
+    const double dst_height = std::max<double>(tview.height() - 1, 1);
+    const auto mat =
+            matrix3x2<double>::get_translate(-dst_width / 2.0, -dst_height / 2.0) *
+            matrix3x2<double>::get_scale(src_width / dst_width, src_height / dst_height) *
+            matrix3x2<double>::get_rotate(-deg * M_PI / 180.) *
+            matrix3x2<double>::get_translate(src_width / 2.0, src_height / 2.0);
+
+    // Least squares of b - (a*c + (1-a)*d) over c per channel gives
+    // c = sum(a * (b - (1-a)*d)) / sum(a^2)
+    double num[3] = {0, 0, 0};
+    double den = 0;
+    point<std::ptrdiff_t> tp;
+    for (tp.y = 0; tp.y < tview.height(); ++tp.y) {
+        for (tp.x = 0; tp.x < tview.width(); ++tp.x) {
+            alpha_pix_t &out = tview(tp.x, tp.y);
+            if (!sample(nearest_neighbor_sampler(), sview, transform(mat, tp), out)) {
+                out = alpha_pix_t(0, 0, 0, 0);
+                continue;
+            }
+
+            int bx = coords.x - tview.width() / 2 + tp.x;
+            int by = coords.y - tview.height() / 2 + tp.y;
+            if (bx < 0 || bx >= cview.width() || by < 0 || by >= cview.height()) continue;
+
+            double salpha = get_color(out, alpha_t()) / 255.0;
+            if (salpha == 0) continue;
+
+            const auto bp = bview(bx, by);
+            const auto cp = cview(bx, by);
+            num[0] += salpha * (at_c<0>(bp) - (1 - salpha) * at_c<0>(cp));
+            num[1] += salpha * (at_c<1>(bp) - (1 - salpha) * at_c<1>(cp));
+            num[2] += salpha * (at_c<2>(bp) - (1 - salpha) * at_c<2>(cp));
+            den += salpha * salpha;
+        }
+    }
+
+    pix_t col(0, 0, 0);
+    if (den > 0) {
+        for (int ch = 0; ch < 3; ++ch) {
+            col[ch] = static_cast<uint8_t>(std::clamp(std::round(num[ch] / den), 0.0, 255.0));
+        }
+    }
+    for (int y = 0; y < tview.height(); ++y) {
+        auto row = tview.row_begin(y);
+        for (int x = 0; x < tview.width(); ++x) {
+            at_c<0>(row[x]) = at_c<0>(col);
+            at_c<1>(row[x]) = at_c<1>(col);
+            at_c<2>(row[x]) = at_c<2>(col);
+        }
+    }
+    return tr_img;
+}
+
+namespace {
+    // Picks source rows/columns for nearest neighbor downscaling of streamed rows.
+    // Owned by the caller of the decoders below, as their setjmp frames must not hold
+    // anything needing destruction
+    class row_downsampler {
+        std::vector<int> src_xs;
+        std::vector<uint8_t> src_row;
+        alpha_img_t::view_t dst;
+        int src_height = 0;
+        int dst_y = 0;
+        bool same_size = false;
+
+        // Source row sampled for the destination row dst_row
+        int src_row_of(int dst_row) const {
+            return static_cast<int>((2 * static_cast<int64_t>(dst_row) + 1) * src_height / (2 * dst.height()));
+        }
+
+    public:
+        void reset(point<int> src_dim, alpha_img_t &dst_img) {
+            dst = view(dst_img);
+            src_height = src_dim.y;
+            dst_y = 0;
+            same_size = src_dim.x == dst.width() && src_dim.y == dst.height();
+            src_xs.resize(same_size ? 0 : dst.width());
+            for (int x = 0; x < static_cast<int>(src_xs.size()); ++x) {
+                src_xs[x] = static_cast<int>((2 * static_cast<int64_t>(x) + 1) * src_dim.x / (2 * dst.width()));
+            }
+        }
+
+        // Scratch memory for the decoders, valid until the next call
+        uint8_t *row_buffer(size_t size) {
+            src_row.resize(size);
+            return src_row.data();
+        }
+
+        // Consumes a source row with channels_count interleaved 8-bit channels
+        void push(int src_y, const uint8_t *row, int channels_count) {
+            if (same_size) {
+                auto drow = dst.row_begin(src_y);
+                for (int x = 0; x < dst.width(); ++x, row += channels_count) {
+                    drow[x] = alpha_pix_t(row[0], row[1], row[2], channels_count > 3 ? row[3] : 255);
+                }
+                return;
+            }
+            for (; dst_y < dst.height() && src_row_of(dst_y) == src_y; ++dst_y) {
+                auto drow = dst.row_begin(dst_y);
+                for (int x = 0; x < dst.width(); ++x) {
+                    const uint8_t *p = row + src_xs[x] * channels_count;
+                    drow[x] = alpha_pix_t(p[0], p[1], p[2], channels_count > 3 ? p[3] : 255);
+                }
+            }
+        }
+    };
+
+    point<int> fit_dimensions(point<int> dim, int max_size) {
+        const int longest = std::max(dim.x, dim.y);
+        if (max_size <= 0 || longest <= max_size) return dim;
+        return {
+            std::max(1, static_cast<int>(std::lround(1. * dim.x * max_size / longest))),
+            std::max(1, static_cast<int>(std::lround(1. * dim.y * max_size / longest))),
+        };
+    }
+
+    struct jpeg_error_ctx {
+        jpeg_error_mgr mgr;
+        std::jmp_buf jmp;
+    };
+
+    void jpeg_error_exit(j_common_ptr cinfo) {
+        std::longjmp(reinterpret_cast<jpeg_error_ctx *>(cinfo->err)->jmp, 1);
+    }
+
+    bool read_jpg(std::FILE *file, alpha_img_t &img, int max_size, row_downsampler &rds) {
+        jpeg_decompress_struct cinfo{};
+        jpeg_error_ctx err{};
+        cinfo.err = jpeg_std_error(&err.mgr);
+        err.mgr.error_exit = jpeg_error_exit;
+        if (setjmp(err.jmp)) {
+            jpeg_destroy_decompress(&cinfo);
+            return false;
+        }
+        jpeg_create_decompress(&cinfo);
+        jpeg_stdio_src(&cinfo, file);
+        jpeg_read_header(&cinfo, TRUE);
+
+        // Let the DCT do most of the downscaling, the rest is done on rows
+        cinfo.out_color_space = JCS_RGB;
+        cinfo.scale_num = 1;
+        cinfo.scale_denom = 1;
+        const JDIMENSION longest = std::max(cinfo.image_width, cinfo.image_height);
+        while (max_size > 0 && cinfo.scale_denom < 8
+               && static_cast<int>((longest + cinfo.scale_denom * 2 - 1) / (cinfo.scale_denom * 2)) >= max_size) {
+            cinfo.scale_denom *= 2;
+        }
+        jpeg_start_decompress(&cinfo);
+
+        const point<int> src_dim(cinfo.output_width, cinfo.output_height);
+        const auto dst_dim = fit_dimensions(src_dim, max_size);
+        img.recreate(dst_dim.x, dst_dim.y);
+        rds.reset(src_dim, img);
+
+        JSAMPROW row = rds.row_buffer(cinfo.output_width * 3);
+        while (cinfo.output_scanline < cinfo.output_height) {
+            const int y = cinfo.output_scanline;
+            jpeg_read_scanlines(&cinfo, &row, 1);
+            rds.push(y, row, 3);
+        }
+        jpeg_finish_decompress(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+        return true;
+    }
+
+    bool read_png(std::FILE *file, alpha_img_t &img, int max_size, row_downsampler &rds) {
+        png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        png_infop info = png ? png_create_info_struct(png) : nullptr;
+        if (!info) {
+            png_destroy_read_struct(&png, nullptr, nullptr);
+            return false;
+        }
+        if (setjmp(png_jmpbuf(png))) {
+            png_destroy_read_struct(&png, &info, nullptr);
+            return false;
+        }
+        png_init_io(png, file);
+        png_read_info(png, info);
+
+        // Normalize everything to 8-bit RGBA
+        png_set_expand(png);
+        png_set_strip_16(png);
+        png_set_gray_to_rgb(png);
+        png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+        const int passes = png_set_interlace_handling(png);
+        png_read_update_info(png, info);
+
+        const point<int> src_dim(png_get_image_width(png, info), png_get_image_height(png, info));
+        const auto dst_dim = fit_dimensions(src_dim, max_size);
+        img.recreate(dst_dim.x, dst_dim.y);
+        rds.reset(src_dim, img);
+
+        const size_t row_bytes = png_get_rowbytes(png, info);
+        if (passes == 1) {
+            png_bytep row = rds.row_buffer(row_bytes);
+            for (int y = 0; y < src_dim.y; ++y) {
+                png_read_row(png, row, nullptr);
+                rds.push(y, row, 4);
+            }
+        } else {
+            // Interlaced rows are complete only after the last pass
+            png_bytep rows = rds.row_buffer(row_bytes * src_dim.y);
+            for (int pass = 0; pass < passes; ++pass) {
+                for (int y = 0; y < src_dim.y; ++y) {
+                    png_read_row(png, rows + row_bytes * y, nullptr);
+                }
+            }
+            for (int y = 0; y < src_dim.y; ++y) {
+                rds.push(y, rows + row_bytes * y, 4);
+            }
+        }
+        png_read_end(png, nullptr);
+        png_destroy_read_struct(&png, &info, nullptr);
+        return true;
+    }
+}
+
+alpha_img_t read_png_or_jpg(const std::string &path, int max_size) {
+    std::unique_ptr<std::FILE, decltype(&std::fclose)> file(std::fopen(path.c_str(), "rb"), &std::fclose);
+    if (!file) {
+        throw std::ios_base::failure("failed to open image: " + path);
+    }
+
+    uint8_t magic[8] = {};
+    const size_t magic_sz = std::fread(magic, 1, sizeof(magic), file.get());
+    std::rewind(file.get());
 
-    try {
-        read_image(path, img, png_tag());
-    } catch (std::ios_base::failure &) {
-        img_t jpg;
-        read_image(path, jpg, jpeg_tag());
-
-        img.recreate(jpg.width(), jpg.height());
-        copy_and_convert_pixels(
-            const_view(jpg),
-            view(img)
-        );
+    alpha_img_t img;
+    row_downsampler rds;
+    if (magic_sz == 8 && !png_sig_cmp(magic, 0, 8)) {
+        if (!read_png(file.get(), img, max_size, rds)) {
+            throw std::ios_base::failure("failed to decode png: " + path);
+        }
+    } else if (magic_sz >= 3 && magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF) {
+        if (!read_jpg(file.get(), img, max_size, rds)) {
+            throw std::ios_base::failure("failed to decode jpeg: " + path);
+        }
+    } else {
+        throw std::ios_base::failure("unsupported image format: " + path);
     }
     return img;
 }
 
+uint64_t image_checksum(const alpha_img_t &img, uint64_t seed) {
+    uint64_t hash = seed;
+    const auto mix = [&hash](uint8_t byte) {
+        hash ^= byte;
+        hash *= 1099511628211ull;
+    };
+    for (int64_t dim: {static_cast<int64_t>(img.width()), static_cast<int64_t>(img.height())}) {
+        for (int i = 0; i < 8; ++i) mix(dim >> (i * 8));
+    }
+
+    auto v = const_view(img);
+    for (int y = 0; y < v.height(); ++y) {
+        auto row = v.row_begin(y);
+        for (int x = 0; x < v.width(); ++x) {
+            mix(at_c<0>(row[x]));
+            mix(at_c<1>(row[x]));
+            mix(at_c<2>(row[x]));
+            mix(at_c<3>(row[x]));
+        }
+    }
+    return hash;
+}
+
 int color_similarity_score(const alpha_pix_t &c1, const alpha_pix_t &c2) {
     int diff = 0;
     diff += std::abs(get_color(c1, red_t()) - get_color(c2, red_t()));
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <filesystem>
+#include <future>
 
 #include <boost/gil/image.hpp>
 #include <boost/gil/extension/io/jpeg.hpp>
@@ -8,25 +9,19 @@
 
 #include <args.hxx>
 
+#include "Distributor.h"
+#include "Engine.h"
 #include "ImageOps.h"
 #include "Parallelizer.h"
 #include "Shaper.h"
 #include "Timestamper.h"
 
 
-struct shape_candidate {
-    int64_t score_delta;
-    shape_metadata md;
-};
-
 enum image_extension {
     EXT_PNG,
     EXT_JPG
 };
 
-#define map_range(a1,a2,b1,b2,s) (b1 + (s - a1) * (b2 - b1) / (a2 - a1))
-#define pretty_score(overall, score) map_range(0, (overall * 765), 0, 10000, score)
-
 int main(int argc, char **argv) {
     args::ArgumentParser parser(
         "Image filter that recreates the source from"
@@ -77,6 +72,32 @@ int main(int argc, char **argv) {
                                               "Resize shapes to specified resolution, if one value is passed,"
                                               "shape will be N*N, if two values - N*M",
                                               {"shape-resize"});
+
+    args::ValueFlag<int> arg_max_input_size(parser, "max_input_size",
+                                            "Downscale the source image while decoding, "
+                                            "so that its longest side is at most N pixels",
+                                            {"max-input-size"}, -1);
+
+    args::Flag arg_reuse_swarm(parser, "reuse_swarm",
+                               "Keep scored swarm candidates not overlapped by the added shape "
+                               "for the next shape instead of regenerating the whole swarm",
+                               {"reuse-swarm"});
+
+    args::Flag arg_optimal_color(parser, "optimal_color",
+                                 "Fit shape color to its rotated and scaled footprint over the canvas "
+                                 "instead of averaging the source under the shape",
+                                 {"optimal-color"});
+
+    args::ValueFlag<std::string> arg_serve(parser, "serve",
+                                           "Run as a worker listening on the address "
+                                           "(unix:PATH or tcp:HOST:PORT) instead of producing an image",
+                                           {"serve"});
+    args::ValueFlagList<std::string> arg_workers(parser, "worker",
+                                                 "Address of a worker to offload scoring to, can be repeated",
+                                                 {"worker"});
+    args::ValueFlag<int> arg_worker_timeout(parser, "worker_timeout",
+                                            "Seconds to wait for a worker before rescoring its share locally",
+                                            {"worker-timeout"}, 60);
     try {
         parser.ParseCLI(argc, argv);
     } catch (const args::Help &) {
@@ -94,15 +115,21 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    const int children_count = args::get(arg_children_count);
-    const int initial_shapes_create_count = args::get(arg_initial_swarm);
-    const int top_shapes_count = args::get(arg_survived_count);
-    const int generations_count = args::get(arg_generations_count);
+    engine_options opts;
+    opts.children_count = args::get(arg_children_count);
+    opts.initial_swarm = args::get(arg_initial_swarm);
+    opts.survived_count = args::get(arg_survived_count);
+    opts.generations_count = args::get(arg_generations_count);
+    opts.threads_count = args::get(arg_threads_count);
+    opts.reuse_swarm = args::get(arg_reuse_swarm);
+    opts.optimal_color = args::get(arg_optimal_color);
+    opts.workers = args::get(arg_workers);
+    opts.worker_timeout = args::get(arg_worker_timeout);
 
     const int score_threshold = args::get(arg_score_threshold);
     const int canvas_shapes_count = score_threshold > 0 ? INT_MAX : args::get(arg_shapes_count);
-    const int threads_count = args::get(arg_threads_count);
     const int shapes_per_save = args::get(arg_shapes_per_save);
+    const int max_input_size = args::get(arg_max_input_size);
 
     std::filesystem::path img_path(args::get(arg_image));
     std::filesystem::path dir_path(args::get(arg_shapes_dir));
@@ -142,108 +169,70 @@ int main(int argc, char **argv) {
     } while (false);
 
     Timestamper ts("prog");
-    Parallelizer pll(threads_count);
 
-    Shaper shp(dir_path, shape_sz);
-    std::cout << ts.stamp() << "Consumed shapes directory" << '\n';
+    // Decode the source while shapes are being consumed
+    auto base_img_fut = std::async(std::launch::async, read_png_or_jpg, img_path.string(), max_input_size);
 
-    auto base_img = read_png_or_jpg(img_path);
-    shp.setBaseImage(base_img);
-    const long base_pix_count = base_img.height() * base_img.width();
-    std::cout << ts.stamp() << "Retrieved base image" << '\n';
+    if (arg_serve) {
+        Parallelizer pll(opts.threads_count);
+        Shaper shp(dir_path, shape_sz);
+        shp.setOptimalColor(opts.optimal_color);
+        std::cout << ts.stamp() << "Consumed shapes directory" << '\n';
 
-    std::vector<shape_candidate> shapes(std::max(top_shapes_count * children_count,
-                                                 initial_shapes_create_count));
-    std::vector<shape_candidate> winners(top_shapes_count);
-    // TODO: create an ability to pass existing canvas
-    alpha_img_t canvas(base_img.dimensions());
-    std::vector<shape_candidate> best_from_gen(generations_count);
+        auto base_img = base_img_fut.get();
+        shp.setBaseImage(base_img);
+        std::cout << ts.stamp() << "Retrieved base image" << '\n';
 
-    fill_pixels(view(canvas), alpha_pix_t(0, 0, 0, 0));
-    std::cout << ts.stamp() << "Created canvas" << '\n';
+        run_worker(args::get(arg_serve), base_img, shp, pll);
+        return 0;
+    }
+
+    Engine engine(dir_path, shape_sz, opts);
+    std::cout << ts.stamp() << "Consumed shapes directory" << '\n';
 
-    long long score = 0;
+    engine.set_base_image(base_img_fut.get());
+    std::cout << ts.stamp() << "Retrieved base image" << '\n';
+    std::cout << ts.stamp() << "Created canvas" << '\n';
+    if (arg_workers) {
+        std::cout << ts.stamp() << "Connected " << engine.get_workers_count() << " workers" << '\n';
+    }
 
-    // TODO: new algorithm - make edge detection
-    // allow coordinates only near edges, then remove this mask
-    // and let it fix the imperfections near edges (expected to be by design already)
+    engine.set_progress_callback([&](const engine_progress &pr) {
+        switch (pr.stage) {
+            case STAGE_SWARM_READY:
+                std::cout << ts.stamp() << "Initial swarm ready";
+                if (opts.reuse_swarm) std::cout << ", evaluated=" << pr.evaluated;
+                std::cout << '\n';
+                ts.sub("gen_mut");
+                break;
+            case STAGE_GENERATION_DONE:
+                std::cout << ts.stamp() << "#" << pr.generation_i + 1
+                        << ": best_raw_score_delta=" << pr.score_delta << '\n';
+                break;
+            case STAGE_SHAPE_ADDED:
+                ts.out();
+                std::cout << ts.stamp() << "Added shape, new_pretty_score=" << pr.pretty_score << '\n';
+                break;
+        }
+    });
 
-    // TODO: make overlay_compare computed by gpu
-    // need to compute each pixel in parallel
-    // adapt image type and matrix type to opencl
-    // simplify GIL if needed
-    // perform matrix multiplications in parallel
     for (int csi = 0; csi < canvas_shapes_count; ++csi) {
         std::cout << "----------------------------------" << '\n';
         ts.sub("shape#" + std::to_string(csi + 1));
-        pll.call(shapes, initial_shapes_create_count, [&](auto sh_it, auto sh_end) {
-            for (; sh_it != sh_end; ++sh_it) {
-                shape_candidate &sh = *sh_it;
-                sh.md = shp.generateShapeData();
-
-                sh.score_delta = overlay_compare(base_img, canvas,
-                                                 shp.applyShapeData(sh.md), sh.md.coords);
-            }
-        });
-        std::sort(shapes.begin(), shapes.begin() + initial_shapes_create_count,
-                  [](const shape_candidate &a, const shape_candidate &b) {
-                      return a.score_delta > b.score_delta;
-                  });
-        std::cout << ts.stamp() << "Initial swarm ready" << '\n';
-
-        // move winners to another storage
-        for (int wi = 0; wi < top_shapes_count; ++wi) {
-            winners[wi] = shapes[wi];
-        }
-
-        ts.sub("gen_mut");
-        for (int gi = 0; gi < generations_count; ++gi) {
-            std::atomic_uint32_t sh_i = 0;
-            pll.call(winners, top_shapes_count,
-                     [&](auto w_it, auto w_end) {
-                         for (; w_it != w_end; ++w_it) {
-                             const shape_candidate &w = *w_it;
-                             for (int ch = 0; ch < children_count; ++ch) {
-                                 auto &[score_delta, md] = shapes[sh_i++];
-                                 md = shp.mutateShapeData(w.md);
-                                 score_delta = overlay_compare(base_img, canvas,
-                                                               shp.applyShapeData(md), md.coords);
-                             }
-                         }
-                     });
-            std::sort(shapes.begin(), shapes.begin() + top_shapes_count * children_count,
-                      [](const shape_candidate &a, const shape_candidate &b) {
-                          return a.score_delta > b.score_delta;
-                      });
-
-            std::cout << ts.stamp() << "#" << gi + 1
-                    << ": best_raw_score_delta=" << shapes[0].score_delta << '\n';
-            best_from_gen[gi] = shapes[0];
-        }
-        std::ranges::sort(best_from_gen,
-                          [](const shape_candidate &a, const shape_candidate &b) {
-                              return a.score_delta > b.score_delta;
-                          });
-        ts.out();
-
-        const auto &winwin = best_from_gen[0];
-        score += winwin.score_delta;
-        overlay_compare(base_img, canvas, shp.applyShapeData(winwin.md), winwin.md.coords, true);
+        engine.step();
 
-        int pr_sc = pretty_score(base_pix_count, score);
-        std::cout << ts.stamp() << "Added shape, new_pretty_score=" << pr_sc << '\n';
         if ((csi + 1) % shapes_per_save == 0) {
-            write_view(out_path, const_view(canvas), boost::gil::png_tag());
+            write_view(out_path, const_view(engine.get_canvas()), boost::gil::png_tag());
             std::cout << ts.stamp() << "Saved canvas" << '\n';
         }
         ts.out();
         if (score_threshold > 0
-            && pr_sc >= score_threshold) {
+            && engine.get_pretty_score() >= score_threshold) {
             break;
         }
         ts.dry_out();
     }
-    write_view(out_path, const_view(canvas), boost::gil::png_tag());
+    write_view(out_path, const_view(engine.get_canvas()), boost::gil::png_tag());
     std::cout << ts.stamp() << "Saved canvas" << '\n';
 
     return 0;
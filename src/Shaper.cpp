@@ -1,5 +1,6 @@
 #include "Shaper.h"
 
+#include <cmath>
 #include <iostream>
 #include <boost/gil/image.hpp>
 
@@ -19,7 +20,8 @@ Shaper::Shaper(const std::string &dir, point<int> shape_sz) {
         try {
             img = read_png_or_jpg(entry.path().string());
         } catch (std::ios_base::failure &) {
-            std::cerr << "Shaper: failed to read image \"" << entry.path().filename().string() << "\"";
+            std::cerr << "Shaper: failed to read image \"" << entry.path().filename().string() << "\"\n";
+            continue;
         }
 
         if (shape_sz.x > 0)
@@ -42,6 +44,14 @@ void Shaper::setBaseImage(const alpha_img_t &img) {
     coords_bounds.yhigh = dim.y * gen_boundaries_sz_mul;
 }
 
+void Shaper::setOptimalColor(bool enabled) {
+    optimal_color = enabled;
+}
+
+bool Shaper::isOptimalColor() const {
+    return optimal_color;
+}
+
 shape_metadata Shaper::mutateShapeData(const shape_metadata &md) const {
     const auto base_img_dim = base_img.dimensions();
     point coords{
@@ -70,8 +80,11 @@ shape_metadata Shaper::mutateShapeData(const shape_metadata &md) const {
     };
 }
 
-alpha_img_t Shaper::applyShapeData(const shape_metadata &md) const {
+alpha_img_t Shaper::applyShapeData(const shape_metadata &md, const alpha_img_t &canvas) const {
     const auto &src_img = templates[md.idx];
+    if (optimal_color) {
+        return transform_image_fit_color(src_img, md.deg, md.sz_mul, base_img, canvas, md.coords);
+    }
 
     auto bview = const_view(base_img);
     auto sview = const_view(src_img);
@@ -123,3 +136,39 @@ shape_metadata Shaper::generateShapeData() const {
 
     return md;
 }
+
+shape_bounds Shaper::getShapeBounds(const shape_metadata &md) const {
+    // Same dimensions as produced by transform_image
+    const auto &src_img = templates[md.idx];
+    auto new_dim = src_img.dimensions() * md.sz_mul;
+    const int width = static_cast<int>(new_dim.x);
+    const int height = static_cast<int>(new_dim.y);
+
+    // Same placement as in overlay_compare
+    const int xlow = md.coords.x - width / 2;
+    const int ylow = md.coords.y - height / 2;
+    return {xlow, xlow + width, ylow, ylow + height};
+}
+
+int Shaper::templatesCount() const {
+    return templates.size();
+}
+
+uint64_t Shaper::templatesChecksum() const {
+    uint64_t hash = image_checksum(alpha_img_t());
+    for (const auto &tmpl: templates) {
+        hash = image_checksum(tmpl, hash);
+    }
+    return hash;
+}
+
+bool Shaper::isValidShapeData(const shape_metadata &md) const {
+    if (md.idx < 0 || md.idx >= templatesCount()) return false;
+    if (!std::isfinite(md.deg) || std::abs(md.deg) > valid_boundaries_shape_deg) return false;
+    if (!std::isfinite(md.sz_mul) || md.sz_mul < 0) return false;
+
+    // Same dimensions as produced by transform_image
+    const auto &src_img = templates[md.idx];
+    const double longest = std::max(src_img.width(), src_img.height()) * md.sz_mul;
+    return longest <= std::max(base_img.width(), base_img.height()) * valid_boundaries_sz_base_img_mul;
+}